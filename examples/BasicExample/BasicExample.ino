@@ -46,17 +46,17 @@ void setup() {
 
   // Please note: GPStar Audio uses 57600 baudrate by default. You can configure this by adding the setting to the Micro SD Card ini configuration file. Please see the README.MD file for more information.
   altSerial.begin(57600); // When using AltSoftSerial.
-  gpstar.start(altSerial);
+  gpstar.begin(altSerial);
 
   //Serial3.begin(57600); // When using hardware serial. Pick the serial port you want to use.
-  //gpstar.start(Serial3);
+  //gpstar.begin(Serial3);
 
-  delay(10);
+  // Any other initialisation can be done here while the hello handshake runs in the background.
 
-  // Allow time for hello command and other data to respond.
-  gpstar.hello();
-
-  delay(500);
+  // The handshake is driven by update() and finishes as soon as GPStar Audio replies.
+  while(!gpstar.isReady() && !gpstar.handshakeFailed()) {
+    gpstar.update();
+  }
 
   if(gpstar.gpstarAudioHello()) {
     // Stop all tracks.
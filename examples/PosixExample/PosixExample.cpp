@@ -0,0 +1,120 @@
+/**
+ *   GPStar Audio example usage on Linux and other POSIX hosts.
+ *   Copyright (C) 2024 Michael Rajotte <michael.rajotte@gpstartechnologies.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ *   This example needs no hardware. It opens a pseudo terminal pair, attaches the library to one end
+ *   and plays the part of GPStar Audio on the other end, checking that every command reaches the board
+ *   as soon as it is issued.
+ *
+ *   Build and run from this folder:
+ *     g++ -std=c++11 -I../../src PosixExample.cpp ../../src/GPStarAudio.cpp ../../src/GPStarAudioPosix.cpp -o PosixExample
+ *     ./PosixExample
+ *
+ *   To use a real board instead, replace the pseudo terminal with:
+ *     port.open("/dev/ttyUSB0", 57600);
+ */
+
+#include <GPStarAudio.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+gpstarPosixSerial port;
+gpstarAudio gpstar;
+
+int board = -1;
+int failures = 0;
+
+// Read whatever the library has sent to the board so far and return whether it contains a frame with the command.
+bool boardReceived(uint8_t cmd) {
+  uint8_t buffer[64];
+  int count = read(board, buffer, sizeof(buffer));
+  bool found = false;
+
+  for(int i = 0; i + 3 < count; i++) {
+    if(buffer[i] == SOM1 && buffer[i + 1] == SOM2 && buffer[i + 3] == cmd) {
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+void check(bool result, const char *description) {
+  printf("%s: %s\n", result ? "ok  " : "FAIL", description);
+
+  if(!result) {
+    failures++;
+  }
+}
+
+int main(void) {
+  struct termios tio;
+
+  board = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+  if(board < 0 || grantpt(board) != 0 || unlockpt(board) != 0) {
+    perror("posix_openpt");
+    return 1;
+  }
+
+  int host = open(ptsname(board), O_RDWR | O_NOCTTY);
+
+  if(host < 0) {
+    perror("open");
+    return 1;
+  }
+
+  tcgetattr(host, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(host, TCSANOW, &tio);
+
+  port.attach(host);
+  gpstar.begin(port);
+
+  check(boardReceived(CMD_GET_GPSTAR_HELLO), "hello is sent by begin() without calling update()");
+
+  // Ignore the first requests so the handshake has to retry.
+  delay(HANDSHAKE_TIMEOUT + 5);
+  gpstar.update();
+
+  check(boardReceived(CMD_GET_GPSTAR_HELLO), "hello retry is sent by the update() call that issued it");
+
+  // Reply as GPStar Audio with 14 voices, 300 tracks and firmware v1.10.
+  const uint8_t hello[] = { SOM1, SOM2, 10, RSP_GPSTAR_HELLO, 14, 0x2c, 0x01, 110, 0, EOM };
+  write(board, hello, sizeof(hello));
+
+  for(int i = 0; i < 100 && !gpstar.isReady(); i++) {
+    port.waitReadable(10);
+    gpstar.update();
+  }
+
+  check(gpstar.isReady(), "handshake completes once the hello reply arrives");
+  check(gpstar.getNumTracks() == 300, "number of tracks is read from the hello reply");
+
+  gpstar.trackPlayPoly(1);
+
+  check(boardReceived(CMD_TRACK_CONTROL), "a track play between update() calls is sent immediately");
+
+  close(host);
+  close(board);
+
+  return failures == 0 ? 0 : 1;
+}
@@ -23,16 +23,328 @@
 
 #include "GPStarAudio.h"
 
+struct gpstarCapability {
+  uint8_t cmd;
+  uint16_t minVersion;
+};
+
+// Commands only understood by GPStar Audio, with the firmware version that introduced them.
+// Anything not listed here is part of the original protocol and is also accepted by the WAV Trigger.
+static const gpstarCapability gpstarCommands[] PROGMEM = {
+  { CMD_GET_TRACK_STATUS,    0 },
+  { CMD_GET_GPSTAR_HELLO,    0 },
+  { CMD_LED_ON,              0 },
+  { CMD_LED_OFF,             0 },
+  { CMD_SHORT_OVERLOAD_ON,   0 },
+  { CMD_SHORT_OVERLOAD_OFF,  0 },
+  { CMD_TRACK_FORCE_ON,      0 },
+  { CMD_TRACK_FORCE_OFF,     0 },
+  { CMD_TRACK_QUEUE_CLEAR,   GPSTAR_FW_TRACK_QUEUE },
+  { CMD_TRACK_CONTROL_QUEUE, GPSTAR_FW_TRACK_QUEUE },
+  { CMD_TRACK_CONTROL_CACHE, GPSTAR_FW_TRACK_QUEUE }
+};
+
+#if GPSTAR_RAMPS
+// Exponential ramp curve (e^4x - 1) / (e^4 - 1) sampled at 17 points, scaled so that 4096 is the full ramp.
+// Kept as integers so that AVR builds do not pull in floating point support.
+static const uint16_t rampExponential[17] PROGMEM = {
+  0, 22, 50, 85, 131, 190, 266, 363, 488, 649, 855, 1119, 1459, 1894, 2454, 3173, 4096
+};
+#endif
+
+#if defined(GPSTAR_COROUTINES)
+alignas(max_align_t) static uint8_t coroutinePool[COROUTINE_POOL_SIZE][COROUTINE_FRAME_SIZE];
+static void* coroutineFreeList = nullptr;
+static bool coroutinePoolReady = false;
+
+void* gpstarCue::promise_type::operator new(size_t size) noexcept {
+  if(!coroutinePoolReady) {
+    // Thread every block of the pool onto the free list the first time a frame is needed.
+    for(uint16_t i = 0; i < COROUTINE_POOL_SIZE; i++) {
+      *(void**)coroutinePool[i] = coroutineFreeList;
+      coroutineFreeList = coroutinePool[i];
+    }
+
+    coroutinePoolReady = true;
+  }
+
+  if(size > COROUTINE_FRAME_SIZE || coroutineFreeList == nullptr) {
+    return nullptr;
+  }
+
+  void* frame = coroutineFreeList;
+  coroutineFreeList = *(void**)frame;
+
+  return frame;
+}
+
+void gpstarCue::promise_type::operator delete(void* ptr) noexcept {
+  *(void**)ptr = coroutineFreeList;
+  coroutineFreeList = ptr;
+}
+
+void gpstarAwaitable::await_suspend(std::coroutine_handle<> h) {
+  handle = h;
+  start = millis();
+  audio->addAwaiter(this);
+
+  if(type == AWAIT_STATUS) {
+    // Sent after registering so that a locally answered status request still resumes the coroutine.
+    audio->trackPlayingStatus(trk);
+  }
+}
+#endif
+
 void gpstarAudio::start(Stream& _port) {
   versionRcvd = false;
   sysInfoRcvd = false;
   gpsInfoRcvd = false;
+  wavTrigger = false;
+  unsupportedCommands = 0;
+  versionNumber = 0;
+  numTracks = 0;
+  numVoices = 0;
+  currentTrack = 0;
+  bCurrentTrackStatus = false;
+  version[0] = 0;
+  handshakeState = HANDSHAKE_IDLE;
+  readyCallback = nullptr;
+#if GPSTAR_RAMPS
+  samplerateRampState.active = false;
+  gainRampState.active = false;
+  lastSamplerateOffset = 0;
+  lastMasterGain = 0;
+  samplerateOffsetSet = false;
+  masterGainSet = false;
+  rampFramesSent = 0;
+  rampFramesNaive = 0;
+#endif
+#if RETRIGGER_SLOTS > 0
+  retriggersSuppressed = 0;
+
+  for(uint8_t i = 0; i < RETRIGGER_SLOTS; i++) {
+    retriggerSlots[i].trk = 0;
+    retriggerSlots[i].rapid = false;
+  }
+#endif
+#if GPSTAR_SNAPSHOT
+  snapshot.epoch = 0;
+#endif
+
+#if defined(GPSTAR_COROUTINES)
+  cancelCues();
+#endif
 
   GPStarSerial = &_port;
 
   flush();
 }
 
+// Non-blocking alternative to start() followed by hello() and a fixed delay.
+// The handshake is driven from update() and the optional callback is invoked once the board has replied.
+void gpstarAudio::begin(Stream& _port, void (*callback)(void)) {
+  start(_port);
+
+  readyCallback = callback;
+  handshakeState = HANDSHAKE_WAITING;
+  handshakeAttempts = 1;
+  handshakeTimeout = HANDSHAKE_TIMEOUT;
+  handshakeTimer = millis();
+
+  handshakeRequest();
+}
+
+// GPStar Audio answers the hello request and a WAV Trigger answers the version string and system info requests,
+// so asking for all three at once lets either board be identified after a single round-trip.
+void gpstarAudio::handshakeRequest(void) {
+#if !defined(ARDUINO)
+  GPStarSerial->beginBatch();
+#endif
+
+  hello();
+  requestVersionString();
+  requestSystemInfo();
+
+#if !defined(ARDUINO)
+  GPStarSerial->endBatch();
+#endif
+}
+
+void gpstarAudio::handshakeUpdate(void) {
+  if(handshakeState != HANDSHAKE_WAITING && handshakeState != HANDSHAKE_FAILED) {
+    return;
+  }
+
+  bool identified = gpsInfoRcvd || (wavTrigger && sysInfoRcvd);
+  bool timedOut = millis() - handshakeTimer >= handshakeTimeout;
+
+  // A board that answered the system info request without identifying itself is still usable once the
+  // current attempt has timed out, but is left unidentified so that no commands are refused.
+  // A reply that arrives after the handshake has given up still completes it.
+  if(identified || (sysInfoRcvd && (timedOut || handshakeState == HANDSHAKE_FAILED))) {
+    handshakeState = HANDSHAKE_READY;
+
+    if(readyCallback != nullptr) {
+      readyCallback();
+    }
+
+    return;
+  }
+
+  if(handshakeState == HANDSHAKE_FAILED || !timedOut) {
+    return;
+  }
+
+  if(handshakeAttempts >= HANDSHAKE_RETRIES) {
+    handshakeState = HANDSHAKE_FAILED;
+    return;
+  }
+
+  handshakeAttempts++;
+  handshakeTimeout = handshakeTimeout * 2;
+  handshakeTimer = millis();
+
+  handshakeRequest();
+}
+
+bool gpstarAudio::isReady(void) {
+  return handshakeState == HANDSHAKE_READY;
+}
+
+bool gpstarAudio::handshakeFailed(void) {
+  return handshakeState == HANDSHAKE_FAILED;
+}
+
+// A hello reply identifies GPStar Audio and its firmware version, and a WAV Trigger is identified by its version string.
+// Until either has been received every command is assumed to be supported.
+bool gpstarAudio::isCommandSupported(uint8_t cmd) {
+  if(!gpsInfoRcvd && !wavTrigger) {
+    return true;
+  }
+
+  for(uint8_t i = 0; i < sizeof(gpstarCommands) / sizeof(gpstarCommands[0]); i++) {
+    if(pgm_read_byte(&gpstarCommands[i].cmd) == cmd) {
+      return gpsInfoRcvd && versionNumber >= pgm_read_word(&gpstarCommands[i].minVersion);
+    }
+  }
+
+  return true;
+}
+
+#if defined(GPSTAR_COROUTINES)
+// Resumes with true once the board reports that the track has stopped on every voice. Requires setReporting() to be enabled.
+gpstarAwaitable gpstarAudio::trackFinished(uint16_t trk, unsigned long timeout) {
+  return gpstarAwaitable(this, AWAIT_TRACK_FINISHED, trk, timeout);
+}
+
+// Asks the board whether the track is playing and resumes with the answer.
+gpstarAwaitable gpstarAudio::status(uint16_t trk, unsigned long timeout) {
+  return gpstarAwaitable(this, AWAIT_STATUS, trk, timeout);
+}
+
+gpstarAwaitable gpstarAudio::sleepMs(unsigned long ms) {
+  return gpstarAwaitable(this, AWAIT_SLEEP, 0, ms);
+}
+
+// Destroys every suspended cue sequence and returns its frame to the pool. Has no effect when called from inside a cue.
+void gpstarAudio::cancelCues(void) {
+  if(resumingAwaiters) {
+    return;
+  }
+
+  while(awaiters != nullptr) {
+    gpstarAwaitable* awaiter = awaiters;
+
+    // The awaiter lives in the coroutine frame, so unlink it before the frame is destroyed.
+    awaiters = awaiter->next;
+    awaiter->handle.destroy();
+  }
+}
+
+void gpstarAudio::addAwaiter(gpstarAwaitable* awaiter) {
+  awaiter->armed = false;
+  awaiter->next = awaiters;
+  awaiters = awaiter;
+}
+
+void gpstarAudio::trackFinishedEvent(uint16_t trk) {
+  for(uint8_t i = 0; i < MAX_NUM_VOICES; i++) {
+    if(voiceTable[i] == trk) {
+      // Still playing on another voice.
+      return;
+    }
+  }
+
+  for(gpstarAwaitable* awaiter = awaiters; awaiter != nullptr; awaiter = awaiter->next) {
+    if(awaiter->type == AWAIT_TRACK_FINISHED && awaiter->trk == trk && !awaiter->done) {
+      awaiter->result = true;
+      awaiter->done = true;
+    }
+  }
+}
+
+void gpstarAudio::trackStatusEvent(uint16_t trk, bool playing) {
+  for(gpstarAwaitable* awaiter = awaiters; awaiter != nullptr; awaiter = awaiter->next) {
+    if(awaiter->type == AWAIT_STATUS && awaiter->trk == trk && !awaiter->done) {
+      awaiter->result = playing;
+      awaiter->done = true;
+    }
+  }
+}
+
+void gpstarAudio::resumeAwaiters(void) {
+  gpstarAwaitable** link = &awaiters;
+  unsigned long now = millis();
+
+  // A resumed coroutine may call update() again through one of the query methods. The events parsed there still
+  // mark awaiters on this list and are picked up by the walk below, so the nested call leaves resuming to us.
+  if(resumingAwaiters) {
+    return;
+  }
+
+  resumingAwaiters = true;
+
+  // Only awaiters registered before this pass are resumed, so a coroutine that waits again straight away cannot loop forever.
+  for(gpstarAwaitable* awaiter = awaiters; awaiter != nullptr; awaiter = awaiter->next) {
+    awaiter->armed = true;
+  }
+
+  // New awaiters are only ever added at the head of the list, so link stays valid across each resume.
+  while(*link != nullptr) {
+    gpstarAwaitable* awaiter = *link;
+
+    if(awaiter->armed && !awaiter->done && awaiter->duration > 0 && now - awaiter->start >= awaiter->duration) {
+      // A sleep has finished, or a track or status wait has timed out.
+      awaiter->result = awaiter->type == AWAIT_SLEEP;
+      awaiter->done = true;
+    }
+
+    if(awaiter->armed && awaiter->done) {
+      *link = awaiter->next;
+      awaiter->handle.resume();
+    }
+    else {
+      link = &awaiter->next;
+    }
+  }
+
+  resumingAwaiters = false;
+}
+#endif
+
+// Number of commands that were not sent, or were sent without some of their options, because the board does not support them.
+uint32_t gpstarAudio::getUnsupportedCommands(void) {
+  return unsupportedCommands;
+}
+
+bool gpstarAudio::isRapidPlaySupported(void) {
+  if(!gpsInfoRcvd && !wavTrigger) {
+    return true;
+  }
+
+  return gpsInfoRcvd && versionNumber >= GPSTAR_FW_RAPID_PLAY;
+}
+
 void gpstarAudio::flush(void) {
   rxCount = 0;
   rxLen = 0;
@@ -42,6 +354,8 @@ void gpstarAudio::flush(void) {
     voiceTable[i] = 0xffff;
   }
 
+  stateChanged = true;
+
   while(GPStarSerial->available()) {
     GPStarSerial->read();
   }
@@ -58,6 +372,11 @@ void gpstarAudio::update(void) {
 
   rxMsgReady = false;
 
+#if !defined(ARDUINO)
+  // Frames issued during this pass are sent together when it ends.
+  GPStarSerial->beginBatch();
+#endif
+
   while(GPStarSerial->available() > 0) {
     dat = GPStarSerial->read();
 
@@ -125,6 +444,10 @@ void gpstarAudio::update(void) {
 
           // Set trackCounter to false to reset it.
           trackCounter = false;
+
+#if defined(GPSTAR_COROUTINES)
+          trackStatusEvent(track, bCurrentTrackStatus);
+#endif
         break;
 
         case RSP_TRACK_REPORT:
@@ -135,6 +458,10 @@ void gpstarAudio::update(void) {
             if(rxMessage[4] == 0) {
               if(track == voiceTable[voice])
                 voiceTable[voice] = 0xffff;
+
+#if defined(GPSTAR_COROUTINES)
+              trackFinishedEvent(track);
+#endif
             }
             else
               voiceTable[voice] = track;
@@ -148,6 +475,7 @@ void gpstarAudio::update(void) {
           }
           version[VERSION_STRING_LEN - 1] = 0;
           versionRcvd = true;
+          wavTrigger = strncmp(version, WAV_TRIGGER_VERSION, sizeof(WAV_TRIGGER_VERSION) - 1) == 0;
         break;
 
         case RSP_SYSTEM_INFO:
@@ -173,14 +501,94 @@ void gpstarAudio::update(void) {
         break;
       }
 
+      stateChanged = true;
+
       rxCount = 0;
       rxLen = 0;
       rxMsgReady = false;
     }
   }
+
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    publishSnapshot();
+  }
+#endif
+
+  handshakeUpdate();
+  rampsUpdate();
+  retriggerUpdate();
+
+#if defined(GPSTAR_COROUTINES)
+  resumeAwaiters();
+#endif
+
+#if !defined(ARDUINO)
+  GPStarSerial->endBatch();
+#endif
+}
+
+#if GPSTAR_SNAPSHOT
+// In snapshot mode, the state seen by the query methods only changes when update() is called.
+// This keeps every answer within one pass of the main loop consistent and avoids parsing the serial port for each query.
+void gpstarAudio::setSnapshotMode(bool enable) {
+  snapshotMode = enable;
+  stateChanged = true;
+  publishSnapshot();
+}
+
+uint32_t gpstarAudio::getEpoch(void) {
+  return snapshot.epoch;
+}
+
+// Outside snapshot mode the snapshot is brought up to date on every call, so it is always filled in.
+const gpstarSnapshot& gpstarAudio::getSnapshot(void) {
+  if(!snapshotMode) {
+    update();
+    publishSnapshot();
+  }
+
+  return snapshot;
+}
+
+void gpstarAudio::publishSnapshot(void) {
+  if(!stateChanged) {
+    return;
+  }
+
+  for(uint8_t i = 0; i < MAX_NUM_VOICES; i++) {
+    snapshot.voiceTable[i] = voiceTable[i];
+  }
+
+  for(uint8_t i = 0; i < VERSION_STRING_LEN; i++) {
+    snapshot.version[i] = version[i];
+  }
+
+  snapshot.numTracks = numTracks;
+  snapshot.versionNumber = versionNumber;
+  snapshot.currentTrack = currentTrack;
+  snapshot.numVoices = numVoices;
+  snapshot.currentTrackStatus = bCurrentTrackStatus;
+  snapshot.trackCounter = trackCounter;
+  snapshot.versionRcvd = versionRcvd;
+  snapshot.sysInfoRcvd = sysInfoRcvd;
+  snapshot.gpsInfoRcvd = gpsInfoRcvd;
+  snapshot.epoch++;
+
+  stateChanged = false;
+}
+#else
+void gpstarAudio::publishSnapshot(void) {
 }
+#endif
 
 bool gpstarAudio::currentTrackStatus(uint16_t trk) {
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    return trk == snapshot.currentTrack && snapshot.currentTrackStatus;
+  }
+#endif
+
   if(trk == currentTrack) {
     if(bCurrentTrackStatus) {
       return true;
@@ -196,6 +604,12 @@ bool gpstarAudio::trackCounterReset() {
 }
 
 bool gpstarAudio::isTrackCounterReset() {
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    return snapshot.trackCounter;
+  }
+#endif
+
   // trackCounter is reset if it is true.
   return trackCounter;
 }
@@ -210,11 +624,32 @@ void gpstarAudio::resetTrackCounter(bool bReset) {
 void gpstarAudio::resetTrackCounter() {
   // Resetting the variable means to set it to true.
   trackCounter = true;
+  stateChanged = true;
 }
 
 void gpstarAudio::trackPlayingStatus(uint16_t trk) {
   uint8_t txbuf[7];
 
+  if(!isCommandSupported(CMD_GET_TRACK_STATUS)) {
+    // Answer locally from the voice reports instead, which requires setReporting() to be enabled.
+    currentTrack = trk;
+    bCurrentTrackStatus = false;
+
+    for(uint8_t i = 0; i < MAX_NUM_VOICES; i++) {
+      if(voiceTable[i] == trk) {
+        bCurrentTrackStatus = true;
+      }
+    }
+
+    trackCounter = false;
+    stateChanged = true;
+
+#if defined(GPSTAR_COROUTINES)
+    trackStatusEvent(trk, bCurrentTrackStatus);
+#endif
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x07;
@@ -226,10 +661,21 @@ void gpstarAudio::trackPlayingStatus(uint16_t trk) {
 }
 
 bool gpstarAudio::isTrackPlaying(uint16_t trk) {
+  const uint16_t* voices = voiceTable;
+
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    voices = snapshot.voiceTable;
+  }
+  else {
+    update();
+  }
+#else
   update();
+#endif
 
   for(uint8_t i = 0; i < MAX_NUM_VOICES; i++) {
-    if(voiceTable[i] == trk) {
+    if(voices[i] == trk) {
       return true;
     }
   }
@@ -238,8 +684,20 @@ bool gpstarAudio::isTrackPlaying(uint16_t trk) {
 }
 
 void gpstarAudio::masterGain(int16_t gain) {
+#if GPSTAR_RAMPS
+  gainRampState.active = false;
+#endif
+  sendMasterGain(gain);
+}
+
+void gpstarAudio::sendMasterGain(int16_t gain) {
   uint8_t txbuf[7];
 
+#if GPSTAR_RAMPS
+  lastMasterGain = gain;
+  masterGainSet = true;
+#endif
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x07;
@@ -275,58 +733,117 @@ void gpstarAudio::setReporting(bool enable) {
 }
 
 bool gpstarAudio::getVersion(char *pDst) {
+  const char* versionString = version;
+  bool received;
+
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    versionString = snapshot.version;
+    received = snapshot.versionRcvd;
+  }
+  else {
+    update();
+    received = versionRcvd;
+  }
+#else
   update();
+  received = versionRcvd;
+#endif
 
-  if(!versionRcvd) {
+  if(!received) {
     return false;
   }
 
   for(uint8_t i = 0; i < (VERSION_STRING_LEN - 1); i++) {
-    pDst[i] = version[i];
+    pDst[i] = versionString[i];
   }
 
   return true;
 }
 
 uint16_t gpstarAudio::getVersionNumber(void) {
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    return snapshot.versionNumber;
+  }
+#endif
+
   return versionNumber;
 }
 
 uint16_t gpstarAudio::getNumTracks(void) {
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    return snapshot.numTracks;
+  }
+#endif
+
   update();
 
   return numTracks;
 }
 
 void gpstarAudio::trackPlaySolo(uint16_t trk) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_SOLO);
 }
 
 void gpstarAudio::trackPlaySolo(uint16_t trk, bool lock) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_SOLO, lock);
 }
 
 void gpstarAudio::trackPlaySolo(uint16_t trk, bool lock, uint16_t i_trk_start_delay) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_SOLO, lock, i_trk_start_delay);
 }
 
 void gpstarAudio::trackPlaySolo(uint16_t trk, bool lock, uint16_t i_trk_start_delay, uint16_t trk2, bool loop_trk2, uint16_t trk2_start_time) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_SOLO, lock, i_trk_start_delay, trk2, loop_trk2, trk2_start_time);
 }
 
 void gpstarAudio::trackPlayPoly(uint16_t trk) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_POLY);
 }
 
 void gpstarAudio::trackPlayPoly(uint16_t trk, bool lock) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_POLY, lock);
 }
 
 void gpstarAudio::trackPlayPoly(uint16_t trk, bool lock, uint16_t i_trk_start_delay) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_POLY, lock, i_trk_start_delay);
 }
 
 void gpstarAudio::trackPlayPoly(uint16_t trk, bool lock, uint16_t i_trk_start_delay, uint16_t trk2, bool loop_trk2, uint16_t trk2_start_time) {
+  if(retriggerSuppressed(trk)) {
+    return;
+  }
+
   trackControl(trk, TRK_PLAY_POLY, lock, i_trk_start_delay, trk2, loop_trk2, trk2_start_time);
 }
 
@@ -362,6 +879,11 @@ void gpstarAudio::trackLoop(uint16_t trk, bool enable) {
 void gpstarAudio::trackRapidPlay(uint16_t trk, uint16_t i_rapid_delay) {
   uint8_t txbuf[10];
 
+  if(!isRapidPlaySupported()) {
+    unsupportedCommands++;
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x0a;
@@ -375,9 +897,136 @@ void gpstarAudio::trackRapidPlay(uint16_t trk, uint16_t i_rapid_delay) {
   GPStarSerial->write(txbuf, 10);
 }
 
+#if RETRIGGER_SLOTS > 0
+// Ignore plays of the same track that arrive within interval milliseconds of the last one sent. 0 disables the limit.
+// With rapidPlay enabled, a burst of retriggers is turned into trackRapidPlay() following the rate of the retriggers,
+// and looping is switched off again once the retriggers stop.
+void gpstarAudio::setRetriggerLimit(uint16_t interval, bool rapidPlay) {
+  retriggerInterval = interval;
+  retriggerRapid = rapidPlay;
+
+  for(uint8_t i = 0; i < RETRIGGER_SLOTS; i++) {
+    retriggerSlots[i].trk = 0;
+    retriggerSlots[i].rapid = false;
+  }
+}
+
+uint32_t gpstarAudio::getRetriggersSuppressed(void) {
+  return retriggersSuppressed;
+}
+
+void gpstarAudio::resetRetriggerCounter(void) {
+  retriggersSuppressed = 0;
+}
+
+bool gpstarAudio::retriggerSuppressed(uint16_t trk) {
+  gpstarRetrigger* slot = nullptr;
+  unsigned long now = millis();
+
+  if(retriggerInterval == 0) {
+    return false;
+  }
+
+  for(uint8_t i = 0; i < RETRIGGER_SLOTS; i++) {
+    if(retriggerSlots[i].trk == trk) {
+      slot = &retriggerSlots[i];
+      break;
+    }
+  }
+
+  if(slot == nullptr) {
+    // A slot whose track has been quiet for a full interval holds nothing worth keeping, so it can be reused.
+    for(uint8_t i = 0; i < RETRIGGER_SLOTS; i++) {
+      if(retriggerSlots[i].trk == 0 || (!retriggerSlots[i].rapid && now - retriggerSlots[i].lastSeen >= retriggerInterval)) {
+        slot = &retriggerSlots[i];
+        break;
+      }
+    }
+
+    if(slot == nullptr) {
+      // Every slot is busy with a track that is retriggering, so let this one through untracked.
+      return false;
+    }
+
+    slot->trk = trk;
+    slot->lastSent = now;
+    slot->lastSeen = now;
+    slot->rapid = false;
+
+    return false;
+  }
+
+  unsigned long gap = now - slot->lastSeen;
+  slot->lastSeen = now;
+
+  if(slot->rapid && gap >= retriggerInterval) {
+    // The burst ended before update() noticed, so stop looping and treat this as a fresh play.
+    slot->rapid = false;
+    trackLoop(trk, false);
+  }
+
+  if(!slot->rapid && now - slot->lastSent >= retriggerInterval) {
+    slot->lastSent = now;
+    return false;
+  }
+
+  if(retriggerRapid && isRapidPlaySupported()) {
+    uint16_t rapidDelay = gap < RETRIGGER_MIN_RAPID ? RETRIGGER_MIN_RAPID : (gap > retriggerInterval ? retriggerInterval : gap);
+
+    if(!slot->rapid) {
+      slot->rapid = true;
+      slot->rapidDelay = rapidDelay;
+      trackRapidPlay(trk, rapidDelay);
+      return true;
+    }
+    else if(abs((int32_t)rapidDelay - slot->rapidDelay) > slot->rapidDelay / 4) {
+      // Only follow the retrigger rate when it has changed noticeably.
+      slot->rapidDelay = rapidDelay;
+      trackRapidDelay(trk, rapidDelay);
+      return true;
+    }
+  }
+
+  retriggersSuppressed++;
+
+  return true;
+}
+
+// Let rapid play tracks finish once their retriggers have stopped.
+void gpstarAudio::retriggerUpdate(void) {
+  unsigned long now = millis();
+
+  if(!retriggerRapid) {
+    return;
+  }
+
+  for(uint8_t i = 0; i < RETRIGGER_SLOTS; i++) {
+    if(retriggerSlots[i].rapid && now - retriggerSlots[i].lastSeen >= retriggerInterval) {
+      retriggerSlots[i].rapid = false;
+      retriggerSlots[i].lastSent = now;
+      trackLoop(retriggerSlots[i].trk, false);
+    }
+  }
+}
+
+#else
+bool gpstarAudio::retriggerSuppressed(uint16_t trk) {
+  (void)trk;
+  return false;
+}
+
+void gpstarAudio::retriggerUpdate(void) {
+}
+#endif
+
 void gpstarAudio::trackRapidDelay(uint16_t trk, uint16_t i_rapid_delay) {
   uint8_t txbuf[10];
 
+  if(!isRapidPlaySupported()) {
+    unsupportedCommands++;
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x0a;
@@ -408,6 +1057,12 @@ void gpstarAudio::trackControl(uint16_t trk, uint8_t code) {
 void gpstarAudio::trackControl(uint16_t trk, uint8_t code, bool lock) {
   uint8_t txbuf[9];
 
+  // An unlocked track is identical to the shorter frame without the lock flag.
+  if(!lock) {
+    trackControl(trk, code);
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x09;
@@ -423,6 +1078,17 @@ void gpstarAudio::trackControl(uint16_t trk, uint8_t code, bool lock) {
 void gpstarAudio::trackControl(uint16_t trk, uint8_t code, bool lock, uint16_t trk1_start_time) {
   uint8_t txbuf[11];
 
+  if(trk1_start_time == 0) {
+    trackControl(trk, code, lock);
+    return;
+  }
+  else if(!isCommandSupported(CMD_TRACK_CONTROL_CACHE)) {
+    // Play the track straight away without the start delay.
+    unsupportedCommands++;
+    trackControl(trk, code, lock);
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x0b;
@@ -440,6 +1106,18 @@ void gpstarAudio::trackControl(uint16_t trk, uint8_t code, bool lock, uint16_t t
 void gpstarAudio::trackControl(uint16_t trk, uint8_t code, bool lock, uint16_t trk1_start_time, uint16_t trk2, bool loop_trk2, uint16_t trk2_start_time) {
   uint8_t txbuf[16];
 
+  // Track numbers start at 1, so a second track of 0 means there is nothing to queue.
+  if(trk2 == 0) {
+    trackControl(trk, code, lock, trk1_start_time);
+    return;
+  }
+  else if(!isCommandSupported(CMD_TRACK_CONTROL_QUEUE)) {
+    // Play the first track straight away. The start delay arrived in the same firmware as queueing, so it is dropped too.
+    unsupportedCommands++;
+    trackControl(trk, code, lock);
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x10;
@@ -462,6 +1140,11 @@ void gpstarAudio::trackControl(uint16_t trk, uint8_t code, bool lock, uint16_t t
 void gpstarAudio::trackQueueClear() {
   uint8_t txbuf[5];
 
+  if(!isCommandSupported(CMD_TRACK_QUEUE_CLEAR)) {
+    unsupportedCommands++;
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x05;
@@ -526,8 +1209,20 @@ void gpstarAudio::trackFade(uint16_t trk, int16_t gain, uint16_t time, bool stop
 }
 
 void gpstarAudio::samplerateOffset(int16_t offset) {
+#if GPSTAR_RAMPS
+  samplerateRampState.active = false;
+#endif
+  sendSamplerateOffset(offset);
+}
+
+void gpstarAudio::sendSamplerateOffset(int16_t offset) {
   uint8_t txbuf[7];
 
+#if GPSTAR_RAMPS
+  lastSamplerateOffset = offset;
+  samplerateOffsetSet = true;
+#endif
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x07;
@@ -538,6 +1233,178 @@ void gpstarAudio::samplerateOffset(int16_t offset) {
   GPStarSerial->write(txbuf, 7);
 }
 
+#if GPSTAR_RAMPS
+// Sweep the sample-rate offset to a target over duration milliseconds, driven by update().
+// The board's starting value may come from the micro SD card ini file, so a ramp can only start once
+// samplerateOffset() has been called at least once. Returns false if it has not.
+bool gpstarAudio::samplerateRamp(int16_t offset, uint16_t duration, uint8_t curve) {
+  if(!samplerateOffsetSet) {
+    return false;
+  }
+
+  startRamp(samplerateRampState, lastSamplerateOffset, offset, duration, curve);
+
+  return true;
+}
+
+// The points array is read while the ramp runs, so it must stay valid until the ramp has finished.
+bool gpstarAudio::samplerateRamp(const gpstarRampPoint* points, uint8_t count) {
+  if(count == 0 || !samplerateOffsetSet) {
+    return false;
+  }
+
+  startRamp(samplerateRampState, lastSamplerateOffset, points[count - 1].value, points[count - 1].time, RAMP_PIECEWISE);
+  samplerateRampState.points = points;
+  samplerateRampState.numPoints = count;
+
+  return true;
+}
+
+// As with samplerateRamp(), masterGain() must have been called at least once before a ramp can start.
+bool gpstarAudio::masterGainRamp(int16_t gain, uint16_t duration, uint8_t curve) {
+  if(!masterGainSet) {
+    return false;
+  }
+
+  startRamp(gainRampState, lastMasterGain, gain, duration, curve);
+
+  return true;
+}
+
+bool gpstarAudio::masterGainRamp(const gpstarRampPoint* points, uint8_t count) {
+  if(count == 0 || !masterGainSet) {
+    return false;
+  }
+
+  startRamp(gainRampState, lastMasterGain, points[count - 1].value, points[count - 1].time, RAMP_PIECEWISE);
+  gainRampState.points = points;
+  gainRampState.numPoints = count;
+
+  return true;
+}
+
+void gpstarAudio::setRampLimits(uint16_t frameInterval, uint16_t samplerateStep, uint16_t gainStep) {
+  rampFrameInterval = frameInterval;
+  rampSamplerateStep = samplerateStep;
+  rampGainStep = gainStep;
+}
+
+bool gpstarAudio::isRampActive(void) {
+  return samplerateRampState.active || gainRampState.active;
+}
+
+// Number of ramp frames actually sent.
+uint32_t gpstarAudio::getRampFramesSent(void) {
+  return rampFramesSent;
+}
+
+// Number of frames that would have been sent by updating the value on every call to update() instead.
+uint32_t gpstarAudio::getRampFramesNaive(void) {
+  return rampFramesNaive;
+}
+
+void gpstarAudio::resetRampCounters(void) {
+  rampFramesSent = 0;
+  rampFramesNaive = 0;
+}
+
+void gpstarAudio::startRamp(gpstarRamp& ramp, int16_t startValue, int16_t targetValue, uint16_t duration, uint8_t curve) {
+  ramp.active = true;
+  ramp.curve = curve;
+  ramp.startValue = startValue;
+  ramp.targetValue = targetValue;
+  ramp.duration = duration;
+  ramp.points = nullptr;
+  ramp.numPoints = 0;
+  ramp.startTime = millis();
+  ramp.lastFrameTime = ramp.startTime - rampFrameInterval;
+}
+
+int16_t gpstarAudio::rampValue(gpstarRamp& ramp, unsigned long elapsed) {
+  int16_t fromValue = ramp.startValue;
+  int16_t toValue = ramp.targetValue;
+  uint16_t fromTime = 0;
+  uint16_t toTime = ramp.duration;
+
+  if(elapsed >= ramp.duration) {
+    return ramp.targetValue;
+  }
+
+  if(ramp.curve == RAMP_PIECEWISE) {
+    // Find the segment containing the elapsed time, starting from the value the ramp began at.
+    for(uint8_t i = 0; i < ramp.numPoints; i++) {
+      if(elapsed < ramp.points[i].time) {
+        toTime = ramp.points[i].time;
+        toValue = ramp.points[i].value;
+        break;
+      }
+
+      fromTime = ramp.points[i].time;
+      fromValue = ramp.points[i].value;
+    }
+  }
+
+  // Progress through the segment, where 4096 is the whole segment.
+  int32_t fraction = (int32_t)(((uint32_t)(elapsed - fromTime) << 12) / (uint32_t)(toTime - fromTime));
+
+  if(ramp.curve == RAMP_EXPONENTIAL) {
+    // Starts slowly and accelerates towards the target, like an engine revving up.
+    uint8_t index = fraction >> 8;
+    int32_t low = pgm_read_word(&rampExponential[index]);
+    int32_t high = pgm_read_word(&rampExponential[index + 1]);
+
+    fraction = low + (((high - low) * (fraction & 0xff)) >> 8);
+  }
+
+  return (int16_t)(fromValue + ((int32_t)(toValue - fromValue) * fraction) / 4096);
+}
+
+// Returns true with the value to send when the ramp has moved far enough from the last value sent and the frame interval has passed.
+bool gpstarAudio::rampUpdate(gpstarRamp& ramp, int16_t lastValue, uint16_t step, unsigned long now, int16_t& value) {
+  unsigned long elapsed = now - ramp.startTime;
+
+  rampFramesNaive++;
+
+  if(now - ramp.lastFrameTime < rampFrameInterval) {
+    return false;
+  }
+
+  value = rampValue(ramp, elapsed);
+
+  if(elapsed >= ramp.duration) {
+    ramp.active = false;
+
+    if(value == lastValue) {
+      return false;
+    }
+  }
+  else if(abs((int32_t)value - lastValue) < step) {
+    return false;
+  }
+
+  ramp.lastFrameTime = now;
+  rampFramesSent++;
+
+  return true;
+}
+
+void gpstarAudio::rampsUpdate(void) {
+  unsigned long now = millis();
+  int16_t value;
+
+  if(samplerateRampState.active && rampUpdate(samplerateRampState, lastSamplerateOffset, rampSamplerateStep, now, value)) {
+    sendSamplerateOffset(value);
+  }
+
+  if(gainRampState.active && rampUpdate(gainRampState, lastMasterGain, rampGainStep, now, value)) {
+    sendMasterGain(value);
+  }
+}
+#else
+void gpstarAudio::rampsUpdate(void) {
+}
+#endif
+
 void gpstarAudio::setTriggerBank(uint8_t bank) {
   uint8_t txbuf[6];
 
@@ -554,6 +1421,11 @@ void gpstarAudio::setTriggerBank(uint8_t bank) {
 void gpstarAudio::gpstarLEDStatus(bool enable) {
   uint8_t txbuf[5];
 
+  if(!isCommandSupported(CMD_LED_ON)) {
+    unsupportedCommands++;
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x05;
@@ -573,6 +1445,11 @@ void gpstarAudio::gpstarLEDStatus(bool enable) {
 void gpstarAudio::gpstarShortTrackOverload(bool enable) {
   uint8_t txbuf[5];
 
+  if(!isCommandSupported(CMD_SHORT_OVERLOAD_ON)) {
+    unsupportedCommands++;
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x05;
@@ -592,6 +1469,11 @@ void gpstarAudio::gpstarShortTrackOverload(bool enable) {
 void gpstarAudio::gpstarTrackForce(bool enable) {
   uint8_t txbuf[5];
 
+  if(!isCommandSupported(CMD_TRACK_FORCE_ON)) {
+    unsupportedCommands++;
+    return;
+  }
+
   txbuf[0] = SOM1;
   txbuf[1] = SOM2;
   txbuf[2] = 0x05;
@@ -641,12 +1523,24 @@ void gpstarAudio::hello(void) {
 }
 
 bool gpstarAudio::wasSysInfoRcvd(void) {
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    return snapshot.sysInfoRcvd;
+  }
+#endif
+
   update();
 
   return sysInfoRcvd;
 }
 
 bool gpstarAudio::gpstarAudioHello(void) {
+#if GPSTAR_SNAPSHOT
+  if(snapshotMode) {
+    return snapshot.gpsInfoRcvd;
+  }
+#endif
+
   update();
 
   return gpsInfoRcvd;
@@ -22,7 +22,19 @@
  */
 
 #pragma once
+
+#if defined(ARDUINO)
 #include "Arduino.h"
+#else
+#include "GPStarAudioPosix.h"
+#endif
+
+// Coroutine awaitables are available when compiling as C++20, such as on the host or newer ESP32 toolchains.
+#if defined(__cpp_impl_coroutine)
+#define GPSTAR_COROUTINES
+#include <coroutine>
+#include <exception>
+#endif
 
 #define CMD_GET_VERSION          1
 #define CMD_GET_SYS_INFO         2
@@ -75,12 +87,196 @@
 #define SOM2   0xaa
 #define EOM    0x55
 
+// Minimum GPStar Audio firmware for newer commands. Firmware v1.04 reports a version number of 104.
+#define GPSTAR_FW_TRACK_QUEUE  104
+#define GPSTAR_FW_RAPID_PLAY   109
+
+// Start of the version string reported by a WAV Trigger, used to tell it apart from GPStar Audio.
+#ifndef WAV_TRIGGER_VERSION
+#define WAV_TRIGGER_VERSION    "WAV Trigger"
+#endif
+
+// Ramp curves for samplerateRamp() and masterGainRamp().
+#define RAMP_LINEAR              0
+#define RAMP_EXPONENTIAL         1
+#define RAMP_PIECEWISE           2
+
+// Ramp defaults. Ramp frames are sent no faster than RAMP_FRAME_INTERVAL milliseconds apart and only once the
+// value has moved by the threshold. 128 samplerate offset steps is roughly 5 cents, below an audible pitch change.
+#define RAMP_FRAME_INTERVAL     20
+#define RAMP_SAMPLERATE_STEP   128
+#define RAMP_GAIN_STEP           1
+
+// The ramp engine takes about 60 bytes of RAM on AVR, so it is left out there unless GPSTAR_RAMPS is set to 1
+// with a build flag.
+#ifndef GPSTAR_RAMPS
+#if defined(__AVR__)
+#define GPSTAR_RAMPS             0
+#else
+#define GPSTAR_RAMPS             1
+#endif
+#endif
+
+// Snapshot mode keeps a second copy of the channel table and replies, which costs 65 bytes of RAM on AVR. It is
+// left out there unless GPSTAR_SNAPSHOT is set to 1 with a build flag.
+#ifndef GPSTAR_SNAPSHOT
+#if defined(__AVR__)
+#define GPSTAR_SNAPSHOT          0
+#else
+#define GPSTAR_SNAPSHOT          1
+#endif
+#endif
+
+// Retrigger limiting for trackPlayPoly() and trackPlaySolo(). A slot is only held by a track while it keeps
+// retriggering, so memory use stays fixed no matter how many track numbers are in use. Each slot costs 13 bytes
+// on AVR, so the feature is left out there unless RETRIGGER_SLOTS is set with a build flag. Setting it to 0 leaves
+// the feature out on any board.
+#ifndef RETRIGGER_SLOTS
+#if defined(__AVR__)
+#define RETRIGGER_SLOTS          0
+#else
+#define RETRIGGER_SLOTS          8
+#endif
+#endif
+#ifndef RETRIGGER_MIN_RAPID
+#define RETRIGGER_MIN_RAPID     30
+#endif
+
+// Handshake timing used by begin(). Timeouts are in milliseconds and double on every retry.
+#define HANDSHAKE_TIMEOUT        20
+#define HANDSHAKE_RETRIES         5
+
+enum HANDSHAKE_STATES {
+  HANDSHAKE_IDLE,
+  HANDSHAKE_WAITING,
+  HANDSHAKE_READY,
+  HANDSHAKE_FAILED
+};
+
+#if GPSTAR_RAMPS
+// A point on a piecewise ramp, reached time milliseconds after the ramp starts.
+struct gpstarRampPoint {
+  uint16_t time;
+  int16_t value;
+};
+
+struct gpstarRamp {
+  bool active;
+  uint8_t curve;
+  int16_t startValue;
+  int16_t targetValue;
+  uint16_t duration;
+  const gpstarRampPoint* points;
+  uint8_t numPoints;
+  unsigned long startTime;
+  unsigned long lastFrameTime;
+};
+#endif
+
+#if GPSTAR_SNAPSHOT
+// State published once per update() when snapshot mode is enabled. The epoch increases every time it changes.
+struct gpstarSnapshot {
+  uint32_t epoch;
+  uint16_t voiceTable[MAX_NUM_VOICES];
+  uint16_t numTracks;
+  uint16_t versionNumber;
+  uint16_t currentTrack;
+  uint8_t numVoices;
+  bool currentTrackStatus;
+  bool trackCounter;
+  bool versionRcvd;
+  bool sysInfoRcvd;
+  bool gpsInfoRcvd;
+  char version[VERSION_STRING_LEN];
+};
+#endif
+
+#if RETRIGGER_SLOTS > 0
+struct gpstarRetrigger {
+  uint16_t trk;
+  unsigned long lastSent;
+  unsigned long lastSeen;
+  uint16_t rapidDelay;
+  bool rapid;
+};
+#endif
+
+#if defined(GPSTAR_COROUTINES)
+// Coroutine frames for gpstarCue are taken from a fixed pool rather than the heap.
+#ifndef COROUTINE_POOL_SIZE
+#define COROUTINE_POOL_SIZE     16
+#endif
+#ifndef COROUTINE_FRAME_SIZE
+#define COROUTINE_FRAME_SIZE   256
+#endif
+
+enum AWAIT_TYPES {
+  AWAIT_TRACK_FINISHED,
+  AWAIT_STATUS,
+  AWAIT_SLEEP
+};
+
+class gpstarAudio;
+
+// Returned by gpstarAudio::trackFinished(), status() and sleepMs() for use with co_await.
+// The suspended coroutine is resumed from gpstarAudio::update(). For trackFinished() and status() the duration is
+// an optional timeout in milliseconds, after which the coroutine is resumed with a result of false.
+class gpstarAwaitable
+{
+public:
+  gpstarAwaitable(gpstarAudio* _audio, AWAIT_TYPES _type, uint16_t _trk, unsigned long _duration) :
+    audio(_audio), next(nullptr), type(_type), trk(_trk), start(0), duration(_duration), armed(false), done(false), result(false) {;}
+  bool await_ready(void) { return type == AWAIT_SLEEP && duration == 0; }
+  void await_suspend(std::coroutine_handle<> h);
+  bool await_resume(void) { return result; }
+
+private:
+  friend class gpstarAudio;
+
+  gpstarAudio* audio;
+  gpstarAwaitable* next;
+  std::coroutine_handle<> handle;
+  AWAIT_TYPES type;
+  uint16_t trk;
+  unsigned long start;
+  unsigned long duration;
+  bool armed;
+  bool done;
+  bool result;
+};
+
+// Return type for cue sequences written as coroutines. The sequence starts running immediately.
+// Converts to false if no coroutine frame was available in the pool and the sequence did not start.
+class gpstarCue
+{
+public:
+  struct promise_type {
+    gpstarCue get_return_object(void) { return gpstarCue(true); }
+    static gpstarCue get_return_object_on_allocation_failure(void) { return gpstarCue(false); }
+    std::suspend_never initial_suspend(void) noexcept { return {}; }
+    std::suspend_never final_suspend(void) noexcept { return {}; }
+    void return_void(void) {}
+    void unhandled_exception(void) { std::terminate(); }
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void* ptr) noexcept;
+  };
+
+  explicit operator bool() const { return started; }
+
+private:
+  explicit gpstarCue(bool _started) : started(_started) {;}
+
+  bool started;
+};
+#endif
+
 class gpstarAudio
 {
 public:
   gpstarAudio() {;}
   ~gpstarAudio() {;}
   void start(Stream& _port);
+  void begin(Stream& _port, void (*callback)(void) = nullptr);
   void update(void);
   void flush(void);
   void setReporting(bool enable);
@@ -101,6 +297,11 @@ public:
   void trackPlayPoly(uint16_t trk, bool lock, uint16_t i_trk_start_delay);
   void trackPlayPoly(uint16_t trk, bool lock, uint16_t i_trk_start_delay, uint16_t trk2, bool loop_trk2, uint16_t trk2_start_time);
   void trackRapidPlay(uint16_t trk, uint16_t i_rapid_delay);
+#if RETRIGGER_SLOTS > 0
+  void setRetriggerLimit(uint16_t interval, bool rapidPlay = false);
+  uint32_t getRetriggersSuppressed(void);
+  void resetRetriggerCounter(void);
+#endif
   void trackRapidDelay(uint16_t trk, uint16_t i_rapid_delay);
   void trackQueueClear(void);
   void trackLoad(uint16_t trk);
@@ -112,6 +313,17 @@ public:
   void trackGain(uint16_t trk, int16_t gain);
   void trackFade(uint16_t trk, int16_t gain, uint16_t time, bool stopFlag = false);
   void samplerateOffset(int16_t offset);
+#if GPSTAR_RAMPS
+  bool samplerateRamp(int16_t offset, uint16_t duration, uint8_t curve = RAMP_LINEAR);
+  bool samplerateRamp(const gpstarRampPoint* points, uint8_t count);
+  bool masterGainRamp(int16_t gain, uint16_t duration, uint8_t curve = RAMP_LINEAR);
+  bool masterGainRamp(const gpstarRampPoint* points, uint8_t count);
+  void setRampLimits(uint16_t frameInterval, uint16_t samplerateStep, uint16_t gainStep);
+  bool isRampActive(void);
+  uint32_t getRampFramesSent(void);
+  uint32_t getRampFramesNaive(void);
+  void resetRampCounters(void);
+#endif
   void setTriggerBank(uint8_t bank);
   void trackPlayingStatus(uint16_t trk);
   bool currentTrackStatus(uint16_t trk);
@@ -128,8 +340,44 @@ public:
   void gpstarTrackForce(bool enable);
   bool wasSysInfoRcvd(void);
   bool gpstarAudioHello(void);
+  bool isReady(void);
+  bool handshakeFailed(void);
+  bool isCommandSupported(uint8_t cmd);
+  uint32_t getUnsupportedCommands(void);
+#if GPSTAR_SNAPSHOT
+  void setSnapshotMode(bool enable);
+  uint32_t getEpoch(void);
+  const gpstarSnapshot& getSnapshot(void);
+#endif
+#if defined(GPSTAR_COROUTINES)
+  gpstarAwaitable trackFinished(uint16_t trk, unsigned long timeout = 0);
+  gpstarAwaitable status(uint16_t trk, unsigned long timeout = 0);
+  gpstarAwaitable sleepMs(unsigned long ms);
+  void cancelCues(void);
+#endif
 
 private:
+  void handshakeUpdate(void);
+  void handshakeRequest(void);
+  void publishSnapshot(void);
+  bool isRapidPlaySupported(void);
+  void sendMasterGain(int16_t gain);
+  void sendSamplerateOffset(int16_t offset);
+#if GPSTAR_RAMPS
+  void startRamp(gpstarRamp& ramp, int16_t startValue, int16_t targetValue, uint16_t duration, uint8_t curve);
+  int16_t rampValue(gpstarRamp& ramp, unsigned long elapsed);
+  bool rampUpdate(gpstarRamp& ramp, int16_t lastValue, uint16_t step, unsigned long now, int16_t& value);
+#endif
+  void rampsUpdate(void);
+  bool retriggerSuppressed(uint16_t trk);
+  void retriggerUpdate(void);
+#if defined(GPSTAR_COROUTINES)
+  friend class gpstarAwaitable;
+  void addAwaiter(gpstarAwaitable* awaiter);
+  void trackFinishedEvent(uint16_t trk);
+  void trackStatusEvent(uint16_t trk, bool playing);
+  void resumeAwaiters(void);
+#endif
   void trackControl(uint16_t trk, uint8_t code);
   void trackControl(uint16_t trk, uint8_t code, bool lock);
   void trackControl(uint16_t trk, uint8_t code, bool lock, uint16_t trk1_start_time);
@@ -149,7 +397,43 @@ private:
   bool versionRcvd;
   bool sysInfoRcvd;
   bool gpsInfoRcvd;
+  bool wavTrigger;
+  uint32_t unsupportedCommands;
   uint16_t currentTrack;
   bool bCurrentTrackStatus;
   bool trackCounter;
+  HANDSHAKE_STATES handshakeState;
+  uint8_t handshakeAttempts;
+  uint16_t handshakeTimeout;
+  unsigned long handshakeTimer;
+  void (*readyCallback)(void);
+#if GPSTAR_RAMPS
+  gpstarRamp samplerateRampState;
+  gpstarRamp gainRampState;
+  int16_t lastSamplerateOffset;
+  int16_t lastMasterGain;
+  bool samplerateOffsetSet;
+  bool masterGainSet;
+  // Settings below are initialised here rather than in start() so that they are kept when start() or begin() is called again.
+  uint16_t rampFrameInterval = RAMP_FRAME_INTERVAL;
+  uint16_t rampSamplerateStep = RAMP_SAMPLERATE_STEP;
+  uint16_t rampGainStep = RAMP_GAIN_STEP;
+  uint32_t rampFramesSent;
+  uint32_t rampFramesNaive;
+#endif
+#if RETRIGGER_SLOTS > 0
+  gpstarRetrigger retriggerSlots[RETRIGGER_SLOTS];
+  uint16_t retriggerInterval = 0;
+  bool retriggerRapid = false;
+  uint32_t retriggersSuppressed;
+#endif
+#if GPSTAR_SNAPSHOT
+  gpstarSnapshot snapshot;
+  bool snapshotMode = false;
+#endif
+  bool stateChanged;
+#if defined(GPSTAR_COROUTINES)
+  gpstarAwaitable* awaiters = nullptr;
+  bool resumingAwaiters = false;
+#endif
 };
\ No newline at end of file
@@ -0,0 +1,380 @@
+/**
+ *   GPStarAudioPosix.cpp
+ *   Copyright (C) 2024 Michael Rajotte <michael.rajotte@gpstartechnologies.com>
+ *
+ *   Host support for running the GPStar Audio serial library on Linux and other POSIX systems.
+ *   Provides the small part of the Arduino API the library relies on and a termios serial port.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#if !defined(ARDUINO)
+
+#include "GPStarAudioPosix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+unsigned long millis(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)(ts.tv_nsec / 1000000L);
+}
+
+void delay(unsigned long ms) {
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+
+  while(nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    // Keep sleeping for the remaining time.
+  }
+}
+
+static speed_t baudToSpeed(uint32_t baud) {
+  switch(baud) {
+    case 9600:
+      return B9600;
+    case 19200:
+      return B19200;
+    case 38400:
+      return B38400;
+    case 57600:
+      return B57600;
+    case 115200:
+      return B115200;
+    case 230400:
+      return B230400;
+    default:
+      return B0;
+  }
+}
+
+// Open and configure a serial device as 8N1 raw, non-blocking.
+bool gpstarPosixSerial::open(const char *device, uint32_t baud) {
+  struct termios tio;
+  speed_t speed = baudToSpeed(baud);
+
+  if(speed == B0) {
+    return false;
+  }
+
+  close();
+
+  int newFd = ::open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+  if(newFd < 0) {
+    return false;
+  }
+
+  if(tcgetattr(newFd, &tio) != 0) {
+    ::close(newFd);
+    return false;
+  }
+
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+
+  if(tcsetattr(newFd, TCSANOW, &tio) != 0) {
+    ::close(newFd);
+    return false;
+  }
+
+  tcflush(newFd, TCIOFLUSH);
+
+  if(!attach(newFd)) {
+    ::close(newFd);
+    return false;
+  }
+
+  ownsFd = true;
+
+  return true;
+}
+
+// Use an already open descriptor, such as one end of a pty pair. The caller keeps ownership.
+bool gpstarPosixSerial::attach(int _fd) {
+  int flags = fcntl(_fd, F_GETFL);
+
+  if(flags < 0 || fcntl(_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    return false;
+  }
+
+  close();
+
+  fd = _fd;
+  ownsFd = false;
+
+  return true;
+}
+
+void gpstarPosixSerial::close(void) {
+  if(fd >= 0 && ownsFd) {
+    ::close(fd);
+  }
+
+  fd = -1;
+  ownsFd = false;
+  rxHead = 0;
+  rxTail = 0;
+  txHead = 0;
+  txTail = 0;
+}
+
+int gpstarPosixSerial::getFd(void) {
+  return fd;
+}
+
+// Events to register with poll() or epoll for this port. Write readiness is only needed while frames are queued.
+short gpstarPosixSerial::pollEvents(void) {
+  if(txPending() > 0) {
+    return POLLIN | POLLOUT;
+  }
+
+  return POLLIN;
+}
+
+// Block for up to timeoutMs waiting for incoming data, sending any queued frames while waiting.
+bool gpstarPosixSerial::waitReadable(int timeoutMs) {
+  struct pollfd pfd;
+
+  if(fd < 0) {
+    return false;
+  }
+
+  flushTx();
+
+  if(rxHead != rxTail) {
+    return true;
+  }
+
+  pfd.fd = fd;
+  pfd.events = pollEvents();
+  pfd.revents = 0;
+
+  if(poll(&pfd, 1, timeoutMs) <= 0) {
+    return false;
+  }
+
+  if(pfd.revents & POLLOUT) {
+    flushTx();
+  }
+
+  return (pfd.revents & POLLIN) != 0;
+}
+
+uint16_t gpstarPosixSerial::txPending(void) {
+  return (uint16_t)((txHead + POSIX_TX_BUFFER_LEN - txTail) % POSIX_TX_BUFFER_LEN);
+}
+
+// Wait for the descriptor to accept more data, giving up POSIX_WRITE_TIMEOUT milliseconds after startTime.
+bool gpstarPosixSerial::waitWritable(unsigned long startTime) {
+  struct pollfd pfd;
+  unsigned long elapsed = millis() - startTime;
+
+  if(fd < 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || elapsed >= POSIX_WRITE_TIMEOUT) {
+    return false;
+  }
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+
+  return poll(&pfd, 1, (int)(POSIX_WRITE_TIMEOUT - elapsed)) > 0;
+}
+
+// Send as much of the queued data as the descriptor accepts. Returns true once the queue is empty.
+bool gpstarPosixSerial::flushTx(void) {
+  while(fd >= 0 && txHead != txTail) {
+    struct iovec iov[2];
+    int iovcnt = 1;
+
+    iov[0].iov_base = &txBuffer[txTail];
+
+    if(txHead > txTail) {
+      iov[0].iov_len = txHead - txTail;
+    }
+    else {
+      // The queued data wraps around the end of the buffer, so send both halves in one call.
+      iov[0].iov_len = POSIX_TX_BUFFER_LEN - txTail;
+
+      if(txHead > 0) {
+        iov[1].iov_base = &txBuffer[0];
+        iov[1].iov_len = txHead;
+        iovcnt = 2;
+      }
+    }
+
+    ssize_t sent = writev(fd, iov, iovcnt);
+
+    if(sent < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return false;
+    }
+
+    txTail = (uint16_t)((txTail + sent) % POSIX_TX_BUFFER_LEN);
+  }
+
+  return txHead == txTail;
+}
+
+void gpstarPosixSerial::fillRx(void) {
+  while(fd >= 0) {
+    uint16_t space;
+
+    if(rxHead >= rxTail) {
+      // Leave one slot free so a full buffer is distinguishable from an empty one.
+      space = (uint16_t)(POSIX_RX_BUFFER_LEN - rxHead - (rxTail == 0 ? 1 : 0));
+    }
+    else {
+      space = (uint16_t)(rxTail - rxHead - 1);
+    }
+
+    if(space == 0) {
+      return;
+    }
+
+    ssize_t count = ::read(fd, &rxBuffer[rxHead], space);
+
+    if(count < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(count <= 0) {
+      return;
+    }
+
+    rxHead = (uint16_t)((rxHead + count) % POSIX_RX_BUFFER_LEN);
+  }
+}
+
+// Anything still queued from an earlier write is retried here so that gpstarAudio::update() services both directions.
+// Inside a batch the queue is left alone until endBatch().
+int gpstarPosixSerial::available(void) {
+  if(batchDepth == 0) {
+    flushTx();
+  }
+
+  if(rxHead == rxTail) {
+    fillRx();
+  }
+
+  return (rxHead + POSIX_RX_BUFFER_LEN - rxTail) % POSIX_RX_BUFFER_LEN;
+}
+
+int gpstarPosixSerial::read(void) {
+  if(rxHead == rxTail) {
+    fillRx();
+
+    if(rxHead == rxTail) {
+      return -1;
+    }
+  }
+
+  uint8_t dat = rxBuffer[rxTail];
+  rxTail = (uint16_t)((rxTail + 1) % POSIX_RX_BUFFER_LEN);
+
+  return dat;
+}
+
+// Returns fewer than size bytes if the port stays stalled for POSIX_WRITE_TIMEOUT milliseconds. The data is queued a
+// frame at a time, so a frame that does not fit is left out whole rather than half sent.
+size_t gpstarPosixSerial::write(const uint8_t *buffer, size_t size) {
+  size_t written = 0;
+  unsigned long startTime = millis();
+
+  while(written < size) {
+    size_t chunk = size - written;
+
+    if(chunk > POSIX_TX_BUFFER_LEN - 1) {
+      chunk = POSIX_TX_BUFFER_LEN - 1;
+    }
+
+    if((size_t)(POSIX_TX_BUFFER_LEN - 1 - txPending()) < chunk) {
+      // Queue is full, so wait for room like the Arduino serial drivers do, but only for a bounded time.
+      if(!flushTx() && !waitWritable(startTime)) {
+        break;
+      }
+
+      continue;
+    }
+
+    for(size_t i = 0; i < chunk; i++) {
+      txBuffer[txHead] = buffer[written + i];
+      txHead = (uint16_t)((txHead + 1) % POSIX_TX_BUFFER_LEN);
+    }
+
+    written += chunk;
+  }
+
+  // Outside a batch, send straight away. Only what the descriptor cannot take right now stays queued.
+  if(batchDepth == 0) {
+    flushTx();
+  }
+
+  return written;
+}
+
+// Matches the Arduino behaviour of waiting until all outgoing data has been transmitted, except that a stalled port
+// is given up on after POSIX_WRITE_TIMEOUT milliseconds.
+void gpstarPosixSerial::flush(void) {
+  unsigned long startTime = millis();
+  int queued = 0;
+
+  while(fd >= 0 && !flushTx()) {
+    if(!waitWritable(startTime)) {
+      return;
+    }
+  }
+
+  // tcdrain() has no timeout, so watch the driver's output queue instead.
+  while(fd >= 0 && ioctl(fd, TIOCOUTQ, &queued) == 0 && queued > 0 && millis() - startTime < POSIX_WRITE_TIMEOUT) {
+    delay(1);
+  }
+}
+
+void gpstarPosixSerial::beginBatch(void) {
+  batchDepth++;
+}
+
+// Sends everything queued during the batch with as few writev() calls as the descriptor allows.
+void gpstarPosixSerial::endBatch(void) {
+  if(batchDepth > 0) {
+    batchDepth--;
+  }
+
+  if(batchDepth == 0) {
+    flushTx();
+  }
+}
+
+#endif
@@ -0,0 +1,104 @@
+/**
+ *   GPStarAudioPosix.h
+ *   Copyright (C) 2024 Michael Rajotte <michael.rajotte@gpstartechnologies.com>
+ *
+ *   Host support for running the GPStar Audio serial library on Linux and other POSIX systems.
+ *   Provides the small part of the Arduino API the library relies on and a termios serial port.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#if !defined(ARDUINO)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POSIX_RX_BUFFER_LEN    256
+#define POSIX_TX_BUFFER_LEN    512
+
+// Longest time in milliseconds that write() and flush() wait for a stalled port before giving up.
+#ifndef POSIX_WRITE_TIMEOUT
+#define POSIX_WRITE_TIMEOUT    100
+#endif
+
+unsigned long millis(void);
+void delay(unsigned long ms);
+
+// Constant tables are placed in flash on AVR. Host builds keep them in ordinary memory.
+#define PROGMEM
+#define pgm_read_byte(addr)    (*(const uint8_t *)(addr))
+#define pgm_read_word(addr)    (*(const uint16_t *)(addr))
+
+// Minimal stand-in for the Arduino Stream class, covering only what gpstarAudio uses.
+class Stream
+{
+public:
+  virtual ~Stream() {;}
+  virtual int available(void) = 0;
+  virtual int read(void) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+  virtual void flush(void) = 0;
+
+  // Frames written between beginBatch() and endBatch() may be held back and sent together.
+  virtual void beginBatch(void) {;}
+  virtual void endBatch(void) {;}
+};
+
+// Non-blocking termios serial port.
+// Frames written outside a batch are sent as soon as they are issued. Frames written inside a batch, such as
+// everything issued during one gpstarAudio::update() pass, are queued and sent together with a single writev().
+// Whatever the descriptor cannot accept is kept queued until it becomes writable, and a stalled port is only
+// waited on for POSIX_WRITE_TIMEOUT milliseconds before write() returns a short count.
+class gpstarPosixSerial : public Stream
+{
+public:
+  gpstarPosixSerial() : fd(-1), ownsFd(false), rxHead(0), rxTail(0), txHead(0), txTail(0), batchDepth(0) {;}
+  ~gpstarPosixSerial() { close(); }
+  bool open(const char *device, uint32_t baud);
+  bool attach(int _fd);
+  void close(void);
+  int getFd(void);
+  short pollEvents(void);
+  bool waitReadable(int timeoutMs);
+  bool flushTx(void);
+  int available(void);
+  int read(void);
+  size_t write(const uint8_t *buffer, size_t size);
+  void flush(void);
+  void beginBatch(void);
+  void endBatch(void);
+
+private:
+  void fillRx(void);
+  uint16_t txPending(void);
+  bool waitWritable(unsigned long startTime);
+
+  int fd;
+  bool ownsFd;
+
+  uint8_t rxBuffer[POSIX_RX_BUFFER_LEN];
+  uint8_t txBuffer[POSIX_TX_BUFFER_LEN];
+  uint16_t rxHead;
+  uint16_t rxTail;
+  uint16_t txHead;
+  uint16_t txTail;
+  uint8_t batchDepth;
+};
+
+#endif